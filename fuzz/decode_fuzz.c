@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "decode_stream.h"
+#include "safe_file.h"
+
+#define MAX_FUZZ_OUTPUT (1 << 24) /* largest output decoded per input */
+
+/* The scratch memory of the buffer API, reused for every input */
+static CodecWorkspace* workspace = NULL;
+
+/**
+ * Decodes an input the way hdecode does: decodeContents reads it from a
+ * memory file on the reader thread and writes through a BufferedWriter to a
+ * second memory file
+ *
+ * @param data - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @param out - where to copy the decompressed bytes
+ * @param capacity - the size of out
+ * @return the number of bytes decodeContents wrote, which are copied to out
+ * if they fit, or -1 if it refused the input
+ */
+static ssize_t decodeThroughFiles(const uint8_t* data, size_t size,
+				  unsigned char* out, size_t capacity) {
+	int infile = memfd_create("decode_fuzz_in", 0);
+	int outfile = memfd_create("decode_fuzz_out", 0);
+	FileReader* reader;
+	BufferedWriter* writer;
+	int status;
+	off_t written;
+	if (infile == -1 || outfile == -1) {
+		perror("Error creating memory file");
+		exit(EXIT_FAILURE);
+	}
+	safe_write(infile, (void*)data, size);
+	lseek(infile, 0, SEEK_SET);
+	reader = createFileReader(infile);
+	writer = createBufferedWriter(outfile);
+	status = decodeContents(reader, writer);
+	freeBufferedWriter(writer);
+	freeFileReader(reader);
+	written = lseek(outfile, 0, SEEK_END);
+	if (status == 0 && (size_t)written <= capacity &&
+	    pread(outfile, out, written, 0) != written) {
+		perror("Error reading memory file");
+		exit(EXIT_FAILURE);
+	}
+	close(infile);
+	close(outfile);
+	return status == 0 ? written : -1;
+}
+
+/**
+ * Decodes one fuzzer input with the buffer API and with hdecode's streaming
+ * decoder. Inputs that claim more than MAX_FUZZ_OUTPUT bytes are only sized,
+ * so a short header cannot make the fuzzer allocate gigabytes. Any
+ * disagreement between hdecodeSize, hdecodeBufferWith and decodeContents
+ * aborts, so the fuzzer records it as a crash.
+ *
+ * @param data - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @return 0, as libFuzzer requires
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	ssize_t decoded_size;
+	if (workspace == NULL) {
+		workspace = (CodecWorkspace*)malloc(codecWorkspaceSize());
+		if (workspace == NULL) {
+			abort();
+		}
+	}
+	decoded_size = hdecodeSizeWith(data, size, workspace);
+	if (decoded_size >= 0 && decoded_size <= MAX_FUZZ_OUTPUT) {
+		/* One spare byte keeps the allocations non-empty */
+		unsigned char* out = (unsigned char*)malloc(decoded_size + 1);
+		unsigned char* streamed =
+		    (unsigned char*)malloc(decoded_size + 1);
+		ssize_t written;
+		if (out == NULL || streamed == NULL) {
+			abort();
+		}
+		written = hdecodeBufferWith(data, size, out, decoded_size,
+					    workspace);
+		if (written >= 0 && written != decoded_size) {
+			abort();
+		}
+		/* The tool must accept exactly what the buffer API accepts and
+		 * write the same bytes */
+		if (decodeThroughFiles(data, size, streamed, decoded_size) !=
+			written ||
+		    (written > 0 && memcmp(out, streamed, written) != 0)) {
+			abort();
+		}
+		/* A buffer one byte short must always be refused */
+		if (decoded_size > 0 &&
+		    hdecodeBufferWith(data, size, out, decoded_size - 1,
+				      workspace) >= 0) {
+			abort();
+		}
+		free(out);
+		free(streamed);
+	}
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/**
+ * Reads a whole stream into memory
+ *
+ * @param file - the stream to read
+ * @param size - where to store the number of bytes read
+ * @return the bytes read, which the caller frees
+ */
+static unsigned char* readAll(FILE* file, size_t* size) {
+	size_t capacity = 4096;
+	unsigned char* data = (unsigned char*)malloc(capacity);
+	size_t bytes_read;
+	*size = 0;
+	while (data != NULL && (bytes_read = fread(data + *size, 1,
+						   capacity - *size, file)) > 0) {
+		*size += bytes_read;
+		if (*size == capacity) {
+			capacity *= 2;
+			data = (unsigned char*)realloc(data, capacity);
+		}
+	}
+	if (data == NULL) {
+		perror("Memory allocation error");
+		exit(EXIT_FAILURE);
+	}
+	return data;
+}
+
+/* Runs the driver without libFuzzer: over each file named on the command
+ * line, or over standard input as AFL provides it */
+int main(int argc, char* argv[]) {
+	unsigned char* data;
+	size_t size;
+	int i;
+	if (argc < 2) {
+		data = readAll(stdin, &size);
+		LLVMFuzzerTestOneInput(data, size);
+		free(data);
+	}
+	for (i = 1; i < argc; i++) {
+		FILE* file = fopen(argv[i], "rb");
+		if (file == NULL) {
+			perror("Error opening file");
+			return EXIT_FAILURE;
+		}
+		data = readAll(file, &size);
+		fclose(file);
+		LLVMFuzzerTestOneInput(data, size);
+		free(data);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,86 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "huffman.h"
+#include "kernels.h"
+
+#ifndef CODEC_H
+#define CODEC_H
+
+typedef struct Block Block;
+typedef struct Estimate Estimate;
+typedef struct CodecWorkspace CodecWorkspace;
+
+/* Represents one block of the compressed format and the codes it implies.
+ * Everything lives inside the struct, so a Block on the stack needs no heap
+ * allocation. */
+struct Block {
+	/* The frequency of each character in the block */
+	uint64_t frequencies[MAX_CODE_LENGTH];
+	/* The frequencies as a FrequencyList, pointing into frequencies */
+	FrequencyList freq_list;
+	/* The nodes of the Huffman tree */
+	HuffmanNode pool[HUFFMAN_POOL_SIZE];
+	/* The root of the Huffman tree, NULL if the block has one character */
+	HuffmanNode* root;
+	/* The codes of every character */
+	CodeTable code_table;
+	/* The number of characters in the block */
+	uint64_t num_chars;
+	/* The number of coded bits after the header */
+	uint64_t num_bits;
+	/* The number of bytes in the header */
+	size_t header_size;
+};
+
+/* Represents the predicted outcome of compressing some input */
+struct Estimate {
+	/* The number of bytes of input */
+	uint64_t input_size;
+	/* The exact number of bytes hencode would write for the input */
+	uint64_t compressed_size;
+	/* The compressed size divided by the input size, 0 for empty input */
+	double ratio;
+	/* The Shannon entropy of the input's blocks in bits per byte */
+	double entropy;
+};
+
+/* Represents the scratch memory of the buffer API. The caller owns it, so a
+ * call neither allocates nor puts it on the stack, and one workspace can be
+ * reused by any number of calls that do not run at the same time. */
+struct CodecWorkspace {
+	/* The block being coded */
+	Block block;
+	/* The decode table and bit position of the block being decoded */
+	Decoder decoder;
+};
+
+void initBlock(Block* block);
+void planBlockCodes(Block* block);
+void planBlock(Block* block, const unsigned char* contents, size_t size);
+ssize_t parseBlock(Block* block, const unsigned char* contents,
+		   const unsigned char* end);
+size_t hencodeBound(size_t size);
+void estimatePlannedBlock(const Block* block, Estimate* estimate);
+void estimateBlock(const unsigned char* contents, size_t size,
+		   Estimate* estimate);
+void combineEstimates(Estimate* total, const Estimate* block);
+void hencodeEstimate(const unsigned char* contents, size_t size,
+		     Estimate* estimate);
+size_t codecWorkspaceSize(void);
+ssize_t hencodeBufferWith(const unsigned char* contents, size_t size,
+			  unsigned char* out, size_t capacity,
+			  CodecWorkspace* workspace);
+ssize_t hencodeBuffer(const unsigned char* contents, size_t size,
+		      unsigned char* out, size_t capacity);
+ssize_t hdecodeSizeWith(const unsigned char* contents, size_t size,
+			CodecWorkspace* workspace);
+ssize_t hdecodeSize(const unsigned char* contents, size_t size);
+ssize_t hdecodeBufferWith(const unsigned char* contents, size_t size,
+			  unsigned char* out, size_t capacity,
+			  CodecWorkspace* workspace);
+ssize_t hdecodeBuffer(const unsigned char* contents, size_t size,
+		      unsigned char* out, size_t capacity);
+
+#endif
@@ -0,0 +1,12 @@
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "safe_file.h"
+
+#ifndef DECODE_STREAM_H
+#define DECODE_STREAM_H
+
+ssize_t decodeBlock(FileReader* reader, size_t start, BufferedWriter* writer);
+int decodeContents(FileReader* reader, BufferedWriter* writer);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 
 #include "safe_file.h"
@@ -7,16 +8,27 @@
 
 #define MAX_CODE_LENGTH 256	    /* total number of characters in ASCII */
 #define HENCODE_ARGUEMENTS_AMOUNT 2 /* number of arguments for the program */
+/* max bytes coded under one header, at most UINT32_MAX so every frequency
+ * fits in a header; tests build with a small value to span many blocks */
+#ifndef MAX_BLOCK_SIZE
+#define MAX_BLOCK_SIZE UINT32_MAX
+#endif
+#define HEADER_CHAR_SIZE 5	    /* bytes per character in a header */
+/* bytes in a header naming every character */
+#define MAX_HEADER_SIZE (1 + HEADER_CHAR_SIZE * MAX_CODE_LENGTH)
+/* nodes needed to build a tree without allocating */
+#define HUFFMAN_POOL_SIZE (2 * MAX_CODE_LENGTH)
 
 typedef struct FrequencyList FrequencyList;
 typedef struct HuffmanNode HuffmanNode;
 typedef struct LinkedList LinkedList;
 typedef struct HuffmanCode HuffmanCode;
+typedef struct CodeTable CodeTable;
 
 /* Represents a list of character frequencies */
 struct FrequencyList {
 	/* The array of frequencies for each ASCII character */
-	unsigned int* frequencies;
+	uint64_t* frequencies;
 	/* The number of non-zero frequencies in the list */
 	unsigned int num_non_zero_freq;
 	/* The size of the list */
@@ -28,7 +40,7 @@ struct HuffmanNode {
 	/* The ASCII character code value */
 	unsigned char char_ascii;
 	/* The frequency of the character associated with the node */
-	int char_freq;
+	uint64_t char_freq;
 	/* The left child of the node */
 	HuffmanNode* left;
 	/* The right child of the node */
@@ -54,10 +66,27 @@ struct HuffmanCode {
 	size_t code_capacity;
 };
 
+/* Represents the Huffman codes of every character as integers */
+struct CodeTable {
+	/* The code of each character, its last bit in the lowest position */
+	uint64_t codes[MAX_CODE_LENGTH];
+	/* The length in bits of each character's code, 0 if it has none */
+	uint8_t lengths[MAX_CODE_LENGTH];
+	/* The length in bits of the longest code */
+	uint8_t max_length;
+};
+
 FrequencyList* createFrequencyList(size_t size);
 FrequencyList* countFrequencies(FileContent* contents);
-void createHeader(FrequencyList* freq_list, int outfile);
-HuffmanNode* createNode(char ascii, int freq, HuffmanNode* left,
+FrequencyList* countBlockFrequencies(const unsigned char* contents,
+				     size_t size);
+void tallyFrequencies(const unsigned char* contents, size_t size,
+		      FrequencyList* freq_list);
+void createHeader(FrequencyList* freq_list, BufferedWriter* writer);
+size_t writeHeader(FrequencyList* freq_list, unsigned char* out);
+ssize_t readHeader(const unsigned char* contents, const unsigned char* end,
+		   FrequencyList* freq_list);
+HuffmanNode* createNode(char ascii, uint64_t freq, HuffmanNode* left,
 			HuffmanNode* right, HuffmanNode* next);
 int comesBefore(HuffmanNode* a, HuffmanNode* b);
 LinkedList* createLinkedList();
@@ -65,8 +94,11 @@ void insertNode(LinkedList* lls, HuffmanNode* node);
 HuffmanNode* removeFirst(LinkedList* lls);
 HuffmanNode* combine(HuffmanNode* a, HuffmanNode* b);
 HuffmanNode* buildHuffmanTree(FrequencyList* frequencies);
+HuffmanNode* buildHuffmanTreeInPool(FrequencyList* frequencies,
+				    HuffmanNode* pool);
 void buildCodesHelper(HuffmanNode* node, char** huffman_codes, char* code_str);
 char** buildCodes(HuffmanNode* node);
+void buildCodeTable(HuffmanNode* node, CodeTable* table);
 void freeFrequencyList(FrequencyList* freq_list);
 void freeHuffmanTree(HuffmanNode* node);
 void freeHuffmanCodes(char** huffman_codes);
@@ -0,0 +1,66 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "huffman.h"
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#define DECODE_TABLE_BITS 15 /* longest code the decode table resolves */
+#define MAX_ENCODE_LENGTH 56 /* longest code the encoder can pack */
+#define ENCODE_SLACK 16      /* extra output bytes a kernel may touch */
+
+typedef struct BitWriter BitWriter;
+typedef struct BitReader BitReader;
+typedef struct Decoder Decoder;
+
+/* Represents the bits packed by the encoder that are not yet written out */
+struct BitWriter {
+	/* The pending bits, the most recent one in the lowest position */
+	uint64_t bits;
+	/* The number of pending bits, always less than a byte between calls */
+	unsigned int count;
+};
+
+/* Represents a position in a stream of big-endian packed bits */
+struct BitReader {
+	/* The next byte to load */
+	const unsigned char* next;
+	/* One past the last byte of the stream, zeros are read past it */
+	const unsigned char* end;
+	/* The loaded bits, the next one in the highest position */
+	uint64_t bits;
+	/* The number of valid loaded bits */
+	unsigned int count;
+	/* The total number of bits loaded, including zeros past the end */
+	uint64_t loaded;
+};
+
+/* Represents the state needed to decode the symbols of one block */
+struct Decoder {
+	/* The length in bits of the longest code */
+	unsigned int max_length;
+	/* The number of bits the table is indexed by */
+	unsigned int table_bits;
+	/* Symbol in the low byte and code length in the high byte, indexed
+	 * by the next table_bits bits of the stream. A length of 0 marks a
+	 * code longer than table_bits, with its subtree index in the low byte */
+	uint16_t table[1 << DECODE_TABLE_BITS];
+	/* The subtrees that start at depth table_bits, walked a bit at a time */
+	HuffmanNode* subtrees[MAX_CODE_LENGTH];
+	/* The number of subtrees */
+	unsigned int num_subtrees;
+	/* The position in the coded bits */
+	BitReader reader;
+};
+
+size_t encodeSymbols(const CodeTable* table, BitWriter* writer,
+		     const unsigned char* contents, size_t size,
+		     unsigned char* out);
+size_t finishEncoding(BitWriter* writer, unsigned char* out);
+void initDecoder(Decoder* decoder, HuffmanNode* root, const CodeTable* table,
+		 const unsigned char* start, const unsigned char* end);
+void decodeSymbols(Decoder* decoder, unsigned char* out, size_t size);
+uint64_t decodedBits(const Decoder* decoder);
+
+#endif
@@ -1,10 +1,16 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #ifndef SAFE_FILE_H
 #define SAFE_FILE_H
 
+#define WRITE_BUFFER_SIZE 65536 /* size in bytes of each output buffer */
+#define READ_AHEAD_SIZE 1048576 /* size in bytes of each background read */
+
 typedef struct FileContent FileContent;
+typedef struct FileReader FileReader;
+typedef struct BufferedWriter BufferedWriter;
 
 /* Represents the contents of a file */
 struct FileContent {
@@ -14,9 +20,67 @@ struct FileContent {
 	unsigned char *file_contents;
 };
 
+/* Represents a file being read into memory on a background thread, so the
+ * coder can start on the first bytes while the rest are still being read */
+struct FileReader {
+	/* The file descriptor to read from */
+	int fd;
+	/* The file contents, filled from the front as they are read */
+	unsigned char *contents;
+	/* The length of the file contents in bytes, known before reading */
+	size_t size;
+	/* The number of bytes read so far */
+	size_t available;
+	/* Whether the reader thread has finished, possibly short of size */
+	int done;
+	/* Whether the reader thread should exit after its current read */
+	int stop;
+	/* Whether the file is read on a background thread */
+	int threaded;
+	/* The background thread reading the file */
+	pthread_t thread;
+	/* Guards available, done and stop */
+	pthread_mutex_t lock;
+	/* Signalled whenever available or done changes */
+	pthread_cond_t cond;
+};
+
+/* Represents a double-buffered writer that flushes on a background thread */
+struct BufferedWriter {
+	/* The file descriptor to write to */
+	int fd;
+	/* The two output buffers, one filled while the other is written */
+	unsigned char *buffers[2];
+	/* The index of the buffer currently being filled */
+	int active;
+	/* The number of bytes in the buffer currently being filled */
+	size_t filled;
+	/* The number of bytes handed to the writer thread, 0 if it is idle */
+	size_t pending;
+	/* Whether the writer thread should exit once it is idle */
+	int done;
+	/* The background thread writing full buffers to the file */
+	pthread_t thread;
+	/* Guards active, pending and done */
+	pthread_mutex_t lock;
+	/* Signalled whenever pending or done changes */
+	pthread_cond_t cond;
+};
+
 int safe_open(char *filename, int flags, mode_t mode);
 FileContent *safe_read(int fd);
+size_t safe_read_chunk(int fd, unsigned char *buf, size_t count);
 void safe_write(int fd, void *buf, size_t count);
+void safe_write_run(int fd, unsigned char byte, size_t count);
 void freeFileContent(FileContent *file_contents);
+FileReader *createFileReader(int fd);
+int waitForBytes(FileReader *reader, size_t count);
+void freeFileReader(FileReader *reader);
+BufferedWriter *createBufferedWriter(int fd);
+void buffered_write(BufferedWriter *writer, const void *buf, size_t count);
+void buffered_write_run(BufferedWriter *writer, unsigned char byte,
+			size_t count);
+void flushBufferedWriter(BufferedWriter *writer);
+void freeBufferedWriter(BufferedWriter *writer);
 
 #endif
@@ -0,0 +1,449 @@
+#include "codec.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "huffman.h"
+#include "kernels.h"
+
+#define BITS_PER_BYTE 8	    /* The number of bits in a byte */
+#define PACK_CHUNK_SIZE 256 /* Symbols packed at once when out is tight */
+#define TAIL_CHUNK_SIZE 64  /* Symbols packed at once near the end of out */
+
+/**
+ * Resets a Block to an empty frequency list
+ *
+ * @param block - the Block to reset
+ */
+void initBlock(Block* block) {
+	memset(block->frequencies, 0, sizeof(block->frequencies));
+	block->freq_list.frequencies = block->frequencies;
+	block->freq_list.num_non_zero_freq = 0;
+	block->freq_list.size = MAX_CODE_LENGTH;
+	block->root = NULL;
+	block->num_chars = 0;
+	block->num_bits = 0;
+}
+
+/**
+ * Builds the tree and codes of a Block from its frequencies and totals the
+ * number of characters and coded bits
+ *
+ * @param block - the Block with at least one non-zero frequency
+ */
+static void buildBlockCodes(Block* block) {
+	int i;
+	memset(&block->code_table, 0, sizeof(CodeTable));
+	if (block->freq_list.num_non_zero_freq > 1) {
+		block->root =
+		    buildHuffmanTreeInPool(&block->freq_list, block->pool);
+		buildCodeTable(block->root, &block->code_table);
+	}
+	for (i = 0; i < MAX_CODE_LENGTH; i++) {
+		block->num_chars += block->frequencies[i];
+		block->num_bits +=
+		    block->frequencies[i] * block->code_table.lengths[i];
+	}
+}
+
+/**
+ * Builds the header size and codes of a Block whose characters have all been
+ * tallied into its frequency list, one run at a time if need be
+ *
+ * @param block - the Block with 1 to MAX_BLOCK_SIZE characters tallied
+ */
+void planBlockCodes(Block* block) {
+	block->header_size =
+	    1 + HEADER_CHAR_SIZE * block->freq_list.num_non_zero_freq;
+	buildBlockCodes(block);
+}
+
+/**
+ * Counts the characters of a block of input and builds their codes
+ *
+ * @param block - the Block to fill in
+ * @param contents - a pointer to the first byte of the block
+ * @param size - the number of bytes in the block, from 1 to MAX_BLOCK_SIZE
+ */
+void planBlock(Block* block, const unsigned char* contents, size_t size) {
+	initBlock(block);
+	tallyFrequencies(contents, size, &block->freq_list);
+	planBlockCodes(block);
+}
+
+/**
+ * Reads the header of a compressed block and builds the codes it implies,
+ * checking that the header and its coded bits fit before the end of input
+ *
+ * @param block - the Block to fill in
+ * @param contents - a pointer to the first byte of the block
+ * @param end - a pointer one past the last byte of the compressed input
+ * @return the number of bytes the block occupies, or -1 if it is malformed
+ */
+ssize_t parseBlock(Block* block, const unsigned char* contents,
+		   const unsigned char* end) {
+	ssize_t header_size;
+	initBlock(block);
+	header_size = readHeader(contents, end, &block->freq_list);
+	if (header_size < 0) {
+		return -1;
+	}
+	block->header_size = header_size;
+	buildBlockCodes(block);
+	/* The header must not promise more bits than the input holds */
+	if (block->num_bits >
+	    (uint64_t)(end - contents - block->header_size) * BITS_PER_BYTE) {
+		return -1;
+	}
+	return block->header_size +
+	       (block->num_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+}
+
+/**
+ * Returns an upper bound on the bytes hencodeBuffer can produce for an input,
+ * not the exact compressed size. A block's Huffman code is never longer than
+ * eight bits per character on average, so the bound is the input size plus
+ * one full header of MAX_HEADER_SIZE bytes per block.
+ *
+ * @param size - the number of bytes to compress
+ * @return the largest possible compressed size in bytes
+ */
+size_t hencodeBound(size_t size) {
+	size_t num_blocks = size / MAX_BLOCK_SIZE + (size % MAX_BLOCK_SIZE > 0);
+	return size + num_blocks * MAX_HEADER_SIZE;
+}
+
+/**
+ * Predicts the result of compressing a block whose codes planBlock or
+ * planBlockCodes has built. The compressed size is exact: it comes from the
+ * same histogram and code lengths hencode uses.
+ *
+ * @param block - the Block with its codes built
+ * @param estimate - the Estimate to fill in
+ */
+void estimatePlannedBlock(const Block* block, Estimate* estimate) {
+	int i;
+	memset(estimate, 0, sizeof(Estimate));
+	estimate->input_size = block->num_chars;
+	estimate->compressed_size =
+	    block->header_size +
+	    (block->num_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+	estimate->ratio = (double)estimate->compressed_size / block->num_chars;
+	for (i = 0; i < MAX_CODE_LENGTH; i++) {
+		if (block->frequencies[i] > 0) {
+			double probability =
+			    (double)block->frequencies[i] / block->num_chars;
+			estimate->entropy -= probability * log2(probability);
+		}
+	}
+}
+
+/**
+ * Predicts the result of compressing one block without emitting any bits
+ *
+ * @param contents - a pointer to the first byte of the block
+ * @param size - the number of bytes in the block, at most MAX_BLOCK_SIZE
+ * @param estimate - the Estimate to fill in
+ */
+void estimateBlock(const unsigned char* contents, size_t size,
+		   Estimate* estimate) {
+	Block block;
+	if (size == 0) {
+		memset(estimate, 0, sizeof(Estimate));
+		return;
+	}
+	planBlock(&block, contents, size);
+	estimatePlannedBlock(&block, estimate);
+}
+
+/**
+ * Adds the estimate of one block to the running estimate of a whole input.
+ * The entropy is the mean of the block entropies weighted by block size,
+ * which is the bound blockwise coding can approach.
+ *
+ * @param total - the Estimate of the blocks so far, zeroed before the first
+ * @param block - the Estimate of the next block
+ */
+void combineEstimates(Estimate* total, const Estimate* block) {
+	uint64_t input_size = total->input_size + block->input_size;
+	if (input_size == 0) {
+		return;
+	}
+	total->entropy = (total->entropy * total->input_size +
+			  block->entropy * block->input_size) /
+			 input_size;
+	total->input_size = input_size;
+	total->compressed_size += block->compressed_size;
+	total->ratio = (double)total->compressed_size / input_size;
+}
+
+/**
+ * Predicts the result of compressing an input of any size, block by block
+ *
+ * @param contents - the bytes to estimate
+ * @param size - the number of bytes to estimate
+ * @param estimate - the Estimate to fill in
+ */
+void hencodeEstimate(const unsigned char* contents, size_t size,
+		     Estimate* estimate) {
+	Estimate block_estimate;
+	size_t offset;
+	memset(estimate, 0, sizeof(Estimate));
+	for (offset = 0; offset < size; offset += MAX_BLOCK_SIZE) {
+		size_t remaining = size - offset;
+		estimateBlock(
+		    contents + offset,
+		    remaining < MAX_BLOCK_SIZE ? remaining : MAX_BLOCK_SIZE,
+		    &block_estimate);
+		combineEstimates(estimate, &block_estimate);
+	}
+}
+
+/**
+ * Packs the coded bits of a block into out. The kernel only over-writes up to
+ * eight bytes past the bits it has packed, so when out has that much to spare
+ * beyond the block's exact size the whole block is packed in place. Otherwise
+ * each chunk is packed in place while its worst case fits, and the last few
+ * symbols go through a small stack buffer.
+ *
+ * @param block - the Block describing contents
+ * @param contents - a pointer to the first byte of the block
+ * @param size - the number of bytes in the block
+ * @param out - where to write the coded bits, with room for all of them
+ * @param out_end - one past the last byte of out
+ * @return the number of bytes written
+ */
+static size_t packBlock(Block* block, const unsigned char* contents,
+			size_t size, unsigned char* out,
+			unsigned char* out_end) {
+	unsigned char tail[TAIL_CHUNK_SIZE * MAX_ENCODE_LENGTH / BITS_PER_BYTE +
+			   ENCODE_SLACK];
+	BitWriter bit_writer = {0, 0};
+	unsigned char* curr = out;
+	size_t offset = 0;
+	if ((uint64_t)(out_end - out) >=
+	    block->num_bits / BITS_PER_BYTE + ENCODE_SLACK) {
+		curr += encodeSymbols(&block->code_table, &bit_writer, contents,
+				      size, curr);
+		offset = size;
+	}
+	while (offset < size) {
+		size_t remaining = size - offset;
+		size_t chunk =
+		    remaining < PACK_CHUNK_SIZE ? remaining : PACK_CHUNK_SIZE;
+		if ((size_t)(out_end - curr) >=
+		    chunk * block->code_table.max_length / BITS_PER_BYTE +
+			ENCODE_SLACK) {
+			curr += encodeSymbols(&block->code_table, &bit_writer,
+					      contents + offset, chunk, curr);
+		} else {
+			size_t written;
+			if (chunk > TAIL_CHUNK_SIZE) {
+				chunk = TAIL_CHUNK_SIZE;
+			}
+			written =
+			    encodeSymbols(&block->code_table, &bit_writer,
+					  contents + offset, chunk, tail);
+			memcpy(curr, tail, written);
+			curr += written;
+		}
+		offset += chunk;
+	}
+	/* The last partial byte is counted in the size checked by the caller */
+	curr += finishEncoding(&bit_writer, curr);
+	return curr - out;
+}
+
+/**
+ * Returns the number of bytes a CodecWorkspace occupies, for callers that
+ * allocate it without the struct definition
+ *
+ * @return the size of a CodecWorkspace in bytes
+ */
+size_t codecWorkspaceSize(void) { return sizeof(CodecWorkspace); }
+
+/**
+ * Compresses a buffer into a caller-provided buffer
+ *
+ * @param block - the Block to code each block of contents with
+ * @param contents - the bytes to compress
+ * @param size - the number of bytes to compress
+ * @param out - where to write the compressed bytes
+ * @param capacity - the size of out
+ * @return the number of bytes written, or -1 if out is too small
+ */
+static ssize_t encodeBuffer(Block* block, const unsigned char* contents,
+			    size_t size, unsigned char* out, size_t capacity) {
+	unsigned char* curr = out;
+	unsigned char* out_end = out + capacity;
+	size_t offset;
+	for (offset = 0; offset < size; offset += MAX_BLOCK_SIZE) {
+		size_t remaining = size - offset;
+		size_t block_size =
+		    remaining < MAX_BLOCK_SIZE ? remaining : MAX_BLOCK_SIZE;
+		planBlock(block, contents + offset, block_size);
+		if ((uint64_t)(out_end - curr) <
+		    block->header_size +
+			(block->num_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE) {
+			return -1;
+		}
+		curr += writeHeader(&block->freq_list, curr);
+		if (block->root != NULL) {
+			curr += packBlock(block, contents + offset, block_size,
+					  curr, out_end);
+		}
+	}
+	return curr - out;
+}
+
+/**
+ * Compresses a buffer into a caller-provided buffer without allocating. The
+ * output is byte-identical to what hencode writes for the same input.
+ *
+ * @param contents - the bytes to compress
+ * @param size - the number of bytes to compress
+ * @param out - where to write the compressed bytes
+ * @param capacity - the size of out, hencodeBound(size) always suffices
+ * @param workspace - the scratch memory to code with
+ * @return the number of bytes written, or -1 if out is too small
+ */
+ssize_t hencodeBufferWith(const unsigned char* contents, size_t size,
+			  unsigned char* out, size_t capacity,
+			  CodecWorkspace* workspace) {
+	return encodeBuffer(&workspace->block, contents, size, out, capacity);
+}
+
+/**
+ * Compresses a buffer like hencodeBufferWith, with a Block of about 25 KB on
+ * the stack as scratch memory
+ *
+ * @param contents - the bytes to compress
+ * @param size - the number of bytes to compress
+ * @param out - where to write the compressed bytes
+ * @param capacity - the size of out, hencodeBound(size) always suffices
+ * @return the number of bytes written, or -1 if out is too small
+ */
+ssize_t hencodeBuffer(const unsigned char* contents, size_t size,
+		      unsigned char* out, size_t capacity) {
+	Block block;
+	return encodeBuffer(&block, contents, size, out, capacity);
+}
+
+/**
+ * Returns the exact size of the decompressed output from the block headers
+ * alone
+ *
+ * @param block - the Block to parse each block of contents into
+ * @param contents - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @return the decompressed size in bytes, or -1 if the input is malformed
+ */
+static ssize_t decodeSize(Block* block, const unsigned char* contents,
+			  size_t size) {
+	const unsigned char* curr = contents;
+	const unsigned char* end = contents + size;
+	uint64_t total = 0;
+	while (curr < end) {
+		ssize_t block_size = parseBlock(block, curr, end);
+		if (block_size < 0) {
+			return -1;
+		}
+		total += block->num_chars;
+		curr += block_size;
+	}
+	return total;
+}
+
+/**
+ * Returns the exact size of the decompressed output from the block headers
+ * alone, validating each block the same way hdecodeBufferWith does
+ *
+ * @param contents - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @param workspace - the scratch memory to parse with
+ * @return the decompressed size in bytes, or -1 if the input is malformed
+ */
+ssize_t hdecodeSizeWith(const unsigned char* contents, size_t size,
+			CodecWorkspace* workspace) {
+	return decodeSize(&workspace->block, contents, size);
+}
+
+/**
+ * Returns the decompressed size like hdecodeSizeWith, with a Block of about
+ * 25 KB on the stack as scratch memory
+ *
+ * @param contents - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @return the decompressed size in bytes, or -1 if the input is malformed
+ */
+ssize_t hdecodeSize(const unsigned char* contents, size_t size) {
+	Block block;
+	return decodeSize(&block, contents, size);
+}
+
+/**
+ * Decompresses a buffer into a caller-provided buffer without allocating
+ *
+ * @param contents - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @param out - where to write the decompressed bytes
+ * @param capacity - the size of out, hdecodeSize(contents, size) suffices
+ * @param workspace - the scratch memory to decode with
+ * @return the number of bytes written, or -1 if the input is malformed or
+ * out is too small
+ */
+ssize_t hdecodeBufferWith(const unsigned char* contents, size_t size,
+			  unsigned char* out, size_t capacity,
+			  CodecWorkspace* workspace) {
+	Block* block = &workspace->block;
+	Decoder* decoder = &workspace->decoder;
+	const unsigned char* curr = contents;
+	const unsigned char* end = contents + size;
+	unsigned char* out_curr = out;
+	while (curr < end) {
+		ssize_t block_size = parseBlock(block, curr, end);
+		if (block_size < 0 ||
+		    block->num_chars > (uint64_t)(out + capacity - out_curr)) {
+			return -1;
+		}
+		if (block->root == NULL) {
+			int ascii = 0;
+			while (block->frequencies[ascii] == 0) {
+				ascii++;
+			}
+			memset(out_curr, ascii, block->num_chars);
+		} else {
+			initDecoder(decoder, block->root, &block->code_table,
+				    curr + block->header_size, end);
+			decodeSymbols(decoder, out_curr, block->num_chars);
+			/* A stream that disagrees with its header is malformed */
+			if (decodedBits(decoder) != block->num_bits) {
+				return -1;
+			}
+		}
+		out_curr += block->num_chars;
+		curr += block_size;
+	}
+	return out_curr - out;
+}
+
+/**
+ * Decompresses a buffer like hdecodeBufferWith, with a CodecWorkspace on the
+ * stack as scratch memory. That is about 90 KB, more than some thread and
+ * coroutine stacks hold, so such callers should use hdecodeBufferWith.
+ *
+ * @param contents - the compressed bytes
+ * @param size - the number of compressed bytes
+ * @param out - where to write the decompressed bytes
+ * @param capacity - the size of out, hdecodeSize(contents, size) suffices
+ * @return the number of bytes written, or -1 if the input is malformed or
+ * out is too small
+ */
+ssize_t hdecodeBuffer(const unsigned char* contents, size_t size,
+		      unsigned char* out, size_t capacity) {
+	CodecWorkspace workspace;
+	return hdecodeBufferWith(contents, size, out, capacity, &workspace);
+}
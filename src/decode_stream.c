@@ -0,0 +1,105 @@
+#include "decode_stream.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "codec.h"
+#include "huffman.h"
+#include "kernels.h"
+#include "safe_file.h"
+#include "safe_mem.h"
+
+#define BITS_PER_BYTE 8 /* The number of bits in a byte */
+#define DECODE_CHUNK_SIZE 65536 /* The number of bytes decoded per kernel call */
+
+/**
+ * @brief Decompresses one block of a compressed file, validating every length
+ * and count against the input size before it is used, so malformed or
+ * hostile input is rejected instead of being read past its end. Each chunk is
+ * decoded as soon as the bits it can reach have been read.
+ *
+ * @param reader - the reader of the compressed file
+ * @param start - the offset of the first byte of the block in the file
+ * @param writer - the writer to write the decompressed bytes to
+ * @return the number of bytes the block occupies, or -1 if it is malformed
+ */
+ssize_t decodeBlock(FileReader* reader, size_t start, BufferedWriter* writer) {
+	const unsigned char* contents = reader->contents + start;
+	const unsigned char* end = reader->contents + reader->size;
+	Block* block = (Block*)safe_malloc(sizeof(Block));
+	ssize_t block_size = -1;
+	/* The count byte gives the header size, which bounds what parseBlock
+	 * reads */
+	if (waitForBytes(reader, start + 1) == 0 &&
+	    waitForBytes(reader, start + 1 + HEADER_CHAR_SIZE *
+					     ((size_t)contents[0] + 1)) == 0) {
+		block_size = parseBlock(block, contents, end);
+	}
+	if (block_size < 0) {
+		safe_free(block);
+		return -1;
+	} else if (block->root == NULL) {
+		unsigned char ascii = 0;
+		while (block->frequencies[ascii] == 0) {
+			ascii++;
+		}
+		buffered_write_run(writer, ascii, block->num_chars);
+	} else {
+		Decoder* decoder = (Decoder*)safe_malloc(sizeof(Decoder));
+		unsigned char* decoded =
+		    (unsigned char*)safe_malloc(DECODE_CHUNK_SIZE);
+		size_t bits_start = start + block->header_size;
+		uint64_t offset;
+		initDecoder(decoder, block->root, &block->code_table,
+			    contents + block->header_size, end);
+		for (offset = 0; offset < block->num_chars;
+		     offset += DECODE_CHUNK_SIZE) {
+			uint64_t remaining = block->num_chars - offset;
+			size_t chunk = remaining < DECODE_CHUNK_SIZE
+					   ? remaining
+					   : DECODE_CHUNK_SIZE;
+			/* Every code is at most max_length bits and a refill
+			 * loads up to a word past the bits it decodes */
+			uint64_t reach =
+			    (decodedBits(decoder) +
+			     (uint64_t)chunk * block->code_table.max_length) /
+				BITS_PER_BYTE +
+			    2 * sizeof(uint64_t);
+			if (waitForBytes(reader, bits_start + reach) != 0) {
+				block_size = -1;
+				break;
+			}
+			decodeSymbols(decoder, decoded, chunk);
+			buffered_write(writer, decoded, chunk);
+		}
+		/* A stream that disagrees with its header is malformed */
+		if (decodedBits(decoder) != block->num_bits) {
+			block_size = -1;
+		}
+		safe_free(decoded);
+		safe_free(decoder);
+	}
+	safe_free(block);
+	return block_size;
+}
+
+/**
+ * @brief Decompresses a compressed file as it is read, one block after
+ * another until the end of the file
+ *
+ * @param reader - the reader of the compressed file
+ * @param writer - the writer to write the decompressed bytes to
+ * @return 0 on success, -1 if the contents are malformed
+ */
+int decodeContents(FileReader* reader, BufferedWriter* writer) {
+	size_t offset = 0;
+	while (offset < reader->size) {
+		ssize_t block_size = decodeBlock(reader, offset, writer);
+		if (block_size < 0) {
+			return -1;
+		}
+		offset += block_size;
+	}
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,79 +9,169 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "codec.h"
 #include "huffman.h"
+#include "kernels.h"
 #include "safe_file.h"
 #include "safe_mem.h"
 
 #define SPECIAL_INT_SIZE 32
 #define BITS_PER_BYTE 8
+#define ENCODE_CHUNK_SIZE 8192 /* The number of bytes packed per kernel call */
+/* The figures of one line of --estimate output, after its label */
+#define ESTIMATE_FORMAT                                                    \
+	"%" PRIu64 " bytes -> %" PRIu64                                    \
+	" bytes (ratio %.4f, entropy %.4f bits/byte)\n"
 
 /**
- * @brief Reads a file and compresses it using Huffman coding
+ * @brief Compresses one block of a file, writing its header followed by its
+ * Huffman coded bits padded to a whole byte. The histogram is tallied a read
+ * at a time, as soon as each part of the block has been read.
+ *
+ * @param reader - the reader of the file being compressed
+ * @param start - the offset of the first byte of the block in the file
+ * @param size - the number of bytes in the block, at most MAX_BLOCK_SIZE
+ * @param writer - the writer to write the compressed block to
+ */
+void encodeBlock(FileReader* reader, size_t start, size_t size,
+		 BufferedWriter* writer) {
+	const unsigned char* contents = reader->contents + start;
+	Block* block = (Block*)safe_malloc(sizeof(Block));
+	size_t offset;
+	initBlock(block);
+	for (offset = 0; offset < size; offset += READ_AHEAD_SIZE) {
+		size_t remaining = size - offset;
+		size_t chunk =
+		    remaining < READ_AHEAD_SIZE ? remaining : READ_AHEAD_SIZE;
+		if (waitForBytes(reader, start + offset + chunk) != 0) {
+			fprintf(stderr,
+				"Error reading file: file changed while "
+				"reading\n");
+			exit(EXIT_FAILURE);
+		}
+		tallyFrequencies(contents + offset, chunk, &block->freq_list);
+	}
+	planBlockCodes(block);
+	createHeader(&block->freq_list, writer);
+	if (block->root != NULL) {
+		unsigned char* coded = (unsigned char*)safe_malloc(
+		    ENCODE_CHUNK_SIZE * MAX_ENCODE_LENGTH / BITS_PER_BYTE +
+		    ENCODE_SLACK);
+		BitWriter bit_writer = {0, 0};
+		/* Pack a chunk at a time so the coded bytes fit in coded */
+		for (offset = 0; offset < size; offset += ENCODE_CHUNK_SIZE) {
+			size_t remaining = size - offset;
+			size_t coded_size = encodeSymbols(
+			    &block->code_table, &bit_writer, contents + offset,
+			    remaining < ENCODE_CHUNK_SIZE ? remaining
+							  : ENCODE_CHUNK_SIZE,
+			    coded);
+			buffered_write(writer, coded, coded_size);
+		}
+		buffered_write(writer, coded, finishEncoding(&bit_writer, coded));
+		safe_free(coded);
+	}
+	safe_free(block);
+}
+
+/**
+ * @brief Reads a file and compresses it using Huffman coding. Files larger
+ * than MAX_BLOCK_SIZE are split into blocks that are compressed one after
+ * another, so every frequency in a header fits in 32 bits
  *
  * @param infile - a pointer to the file to read from
  * @param outfile - a pointer to the file to write to
  */
 void hencode(int infile, int outfile) {
-	FileContent* file_contents = safe_read(infile);
-	if (file_contents->file_size == 0) {
-		freeFileContent(file_contents);
-	} else if (file_contents->file_size == 1) {
-		FrequencyList* char_freq = countFrequencies(file_contents);
-		createHeader(char_freq, outfile);
-		freeFileContent(file_contents);
-		freeFrequencyList(char_freq);
-	} else {
-		FrequencyList* char_freq = countFrequencies(file_contents);
-		createHeader(char_freq, outfile);
-		HuffmanNode* root = buildHuffmanTree(char_freq);
-		char** huffman_codes = buildCodes(root);
-		int count = 0;
-		uint32_t frequencyNetworkByte = 0;
-		char* correspondingCode = NULL;
-		int i;
-		int j;
-		for (i = 0; i < file_contents->file_size; i++) {
-			correspondingCode =
-			    huffman_codes[(int)file_contents->file_contents[i]];
-			for (j = 0; j < strlen(correspondingCode); j++) {
-				if (correspondingCode[j] == '1') {
-					frequencyNetworkByte |=
-					    (1 << ((sizeof(correspondingCode) *
-						    BITS_PER_BYTE) -
-						   1 - count));
-				}
-				count++;
-				if (count == sizeof(uint32_t) * BITS_PER_BYTE) {
-					frequencyNetworkByte =
-					    htonl(frequencyNetworkByte);
-					safe_write(outfile,
-						   &frequencyNetworkByte,
-						   sizeof(uint32_t));
-					frequencyNetworkByte = 0;
-					count = 0;
-				}
+	FileReader* reader = createFileReader(infile);
+	BufferedWriter* writer = createBufferedWriter(outfile);
+	size_t offset;
+	for (offset = 0; offset < reader->size; offset += MAX_BLOCK_SIZE) {
+		size_t remaining = reader->size - offset;
+		encodeBlock(reader, offset,
+			    remaining < MAX_BLOCK_SIZE ? remaining
+						       : MAX_BLOCK_SIZE,
+			    writer);
+	}
+	freeFileReader(reader);
+	freeBufferedWriter(writer); /* Flush and free the output buffers */
+}
+
+/**
+ * @brief Builds the codes of a block whose bytes have all been tallied,
+ * prints its estimate and adds it to the running total
+ *
+ * @param block - the Block with its frequencies tallied
+ * @param block_index - the position of the block in the file
+ * @param total - the Estimate of the blocks before this one
+ * @param outfile - a pointer to the file to print the estimate to
+ */
+static void printBlockEstimate(Block* block, size_t block_index,
+			       Estimate* total, FILE* outfile) {
+	Estimate estimate;
+	planBlockCodes(block);
+	estimatePlannedBlock(block, &estimate);
+	fprintf(outfile, "block %zu: " ESTIMATE_FORMAT, block_index,
+		estimate.input_size, estimate.compressed_size, estimate.ratio,
+		estimate.entropy);
+	combineEstimates(total, &estimate);
+}
+
+/**
+ * @brief Reads a file once and prints the size compressing it would produce,
+ * the compression ratio and the entropy of each block, without compressing
+ * it. The file is tallied READ_AHEAD_SIZE bytes at a time, so memory use does
+ * not grow with the file.
+ *
+ * @param infile - a pointer to the file to read from
+ * @param outfile - a pointer to the file to print the estimate to
+ */
+void hestimate(int infile, FILE* outfile) {
+	unsigned char* chunk = (unsigned char*)safe_malloc(READ_AHEAD_SIZE);
+	Block* block = (Block*)safe_malloc(sizeof(Block));
+	Estimate total;
+	size_t block_index = 0;
+	uint64_t block_size = 0; /* The bytes tallied into block so far */
+	size_t chunk_size;
+	memset(&total, 0, sizeof(Estimate));
+	initBlock(block);
+	while ((chunk_size = safe_read_chunk(infile, chunk, READ_AHEAD_SIZE)) >
+	       0) {
+		size_t offset = 0;
+		/* A chunk may straddle the end of a block */
+		while (offset < chunk_size) {
+			uint64_t room = MAX_BLOCK_SIZE - block_size;
+			size_t amount = chunk_size - offset < room
+					    ? chunk_size - offset
+					    : room;
+			tallyFrequencies(chunk + offset, amount,
+					 &block->freq_list);
+			block_size += amount;
+			offset += amount;
+			if (block_size == MAX_BLOCK_SIZE) {
+				printBlockEstimate(block, block_index++, &total,
+						   outfile);
+				initBlock(block);
+				block_size = 0;
 			}
 		}
-		/* Change the byte order to network byte order (big endian) */
-		frequencyNetworkByte = htonl(frequencyNetworkByte);
-		/* Write the byte to the file if the byte is full */
-		if (count % BITS_PER_BYTE) {
-			safe_write(outfile, &frequencyNetworkByte,
-				   (count / BITS_PER_BYTE) + 1);
-		} else {
-			safe_write(outfile, &frequencyNetworkByte,
-				   count / BITS_PER_BYTE);
-		}
-		freeFileContent(file_contents);
-		freeFrequencyList(char_freq);
-		freeHuffmanTree(root);		 /* Free the Huffman tree */
-		freeHuffmanCodes(huffman_codes); /* Free the Huffman codes */
 	}
+	if (block_size > 0) {
+		printBlockEstimate(block, block_index++, &total, outfile);
+	}
+	fprintf(outfile, "total (%zu block%s): " ESTIMATE_FORMAT, block_index,
+		block_index == 1 ? "" : "s", total.input_size,
+		total.compressed_size, total.ratio, total.entropy);
+	safe_free(block);
+	safe_free(chunk);
 }
 
 int main(int argc, char* argv[]) {
-	if (argc == 2) {
+	if (argc == 3 && strcmp(argv[1], "--estimate") == 0) {
+		int infile = safe_open(*(argv + 2), O_RDONLY, S_IRWXU);
+		hestimate(infile, stdout);
+		close(infile);
+	} else if (argc == 2) {
 		int infile = safe_open(*(argv + 1), O_RDONLY, S_IRWXU);
 		int outfile = fileno(stdout);
 		hencode(infile, outfile);
@@ -93,7 +184,10 @@ int main(int argc, char* argv[]) {
 		close(infile);
 		close(outfile);
 	} else {
-		fprintf(stderr, "Usage: %s infile [ outfile ]\n", argv[0]);
+		fprintf(stderr,
+			"Usage: %s infile [ outfile ]\n"
+			"       %s --estimate infile\n",
+			argv[0], argv[0]);
 		return EXIT_FAILURE;
 	}
 	return 0;
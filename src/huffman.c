@@ -12,6 +12,9 @@
 
 #include "safe_file.h"
 #include "safe_mem.h"
+
+#define HISTOGRAM_WAYS 4 /* The number of tables bytes are counted in */
+
 /**
  * Creates a FrequencyList
  *
@@ -23,7 +26,7 @@ FrequencyList* createFrequencyList(size_t size) {
 	freq->num_non_zero_freq = 0;
 	freq->size = size;
 	freq->frequencies =
-	    (unsigned int*)safe_calloc(freq->size, sizeof(unsigned int));
+	    (uint64_t*)safe_calloc(freq->size, sizeof(uint64_t));
 	return freq;
 }
 
@@ -34,40 +37,129 @@ FrequencyList* createFrequencyList(size_t size) {
  * @return an array of character frequencies in ascending asci order
  */
 FrequencyList* countFrequencies(FileContent* file_contents) {
+	return countBlockFrequencies(file_contents->file_contents,
+				     file_contents->file_size);
+}
+
+/**
+ * Counts the frequency of each character in a block of bytes
+ *
+ * @param contents - a pointer to the first byte of the block
+ * @param size - the number of bytes in the block
+ * @return an array of character frequencies in ascending asci order
+ */
+FrequencyList* countBlockFrequencies(const unsigned char* contents,
+				     size_t size) {
 	FrequencyList* char_freq = createFrequencyList(MAX_CODE_LENGTH);
-	int i;
-	for (i = 0; i < file_contents->file_size; i++) {
-		if (char_freq
-			->frequencies[(int)file_contents->file_contents[i]] ==
-		    0) {
-			char_freq->num_non_zero_freq++;
+	tallyFrequencies(contents, size, char_freq);
+	return char_freq;
+}
+
+/**
+ * Adds the frequency of each character in a block of bytes to a list.
+ * Consecutive bytes are counted in separate tables that are summed at the
+ * end, so runs of one character do not serialize on a single counter.
+ *
+ * @param contents - a pointer to the first byte of the block
+ * @param size - the number of bytes in the block
+ * @param freq_list - the FrequencyList to add to
+ */
+void tallyFrequencies(const unsigned char* contents, size_t size,
+		      FrequencyList* freq_list) {
+	uint64_t counts[HISTOGRAM_WAYS][MAX_CODE_LENGTH];
+	size_t i;
+	int j;
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i + HISTOGRAM_WAYS <= size; i += HISTOGRAM_WAYS) {
+		counts[0][contents[i]]++;
+		counts[1][contents[i + 1]]++;
+		counts[2][contents[i + 2]]++;
+		counts[3][contents[i + 3]]++;
+	}
+	for (; i < size; i++) {
+		counts[0][contents[i]]++;
+	}
+	for (i = 0; i < MAX_CODE_LENGTH; i++) {
+		uint64_t count = 0;
+		for (j = 0; j < HISTOGRAM_WAYS; j++) {
+			count += counts[j][i];
 		}
-		char_freq->frequencies[(int)file_contents->file_contents[i]]++;
+		if (freq_list->frequencies[i] == 0 && count > 0) {
+			freq_list->num_non_zero_freq++;
+		}
+		freq_list->frequencies[i] += count;
 	}
-	return char_freq;
 }
+
 /**
  * Read a frequency list and write it to a file as a header
  *
- * @param ascii - the ASCII character
- * @param freq - the frequency of the character
- * @param left - the left child of the node
- * @param right - the right child of the node
- * @return a pointer to the node
+ * @param freq_list - the frequencies of a block, each fitting in 32 bits
+ * @param writer - the writer to write the header to
+ */
+void createHeader(FrequencyList* freq_list, BufferedWriter* writer) {
+	unsigned char header[MAX_HEADER_SIZE];
+	buffered_write(writer, header, writeHeader(freq_list, header));
+}
+
+/**
+ * Writes a frequency list to memory as a header: the number of characters
+ * minus one, then each character followed by its big-endian frequency
+ *
+ * @param freq_list - the frequencies of a block, each fitting in 32 bits
+ * @param out - where to write the header, with room for MAX_HEADER_SIZE bytes
+ * @return the number of bytes written
  */
-void createHeader(FrequencyList* freq_list, int outfile) {
-	uint8_t size = freq_list->num_non_zero_freq - 1;
-	safe_write(outfile, &size, sizeof(uint8_t));
+size_t writeHeader(FrequencyList* freq_list, unsigned char* out) {
+	unsigned char* curr = out;
 	int i;
+	*curr = freq_list->num_non_zero_freq - 1;
+	curr += sizeof(uint8_t);
 	for (i = 0; i < freq_list->size; i++) {
 		if (freq_list->frequencies[i] > 0) {
-			uint8_t ascii = i;
-			uint32_t frequency = freq_list->frequencies[i];
-			frequency = htonl(frequency);
-			safe_write(outfile, &ascii, sizeof(uint8_t));
-			safe_write(outfile, &frequency, sizeof(uint32_t));
+			uint32_t frequency = htonl(freq_list->frequencies[i]);
+			*curr = i;
+			memcpy(curr + sizeof(uint8_t), &frequency,
+			       sizeof(uint32_t));
+			curr += HEADER_CHAR_SIZE;
 		}
 	}
+	return curr - out;
+}
+
+/**
+ * Reads a header from memory into an empty frequency list, checking that it
+ * fits before the end of the input and names each of its characters once
+ * with a non-zero frequency, as createHeader writes it
+ *
+ * @param contents - a pointer to the first byte of the header
+ * @param end - a pointer one past the last byte of the input
+ * @param freq_list - the empty FrequencyList to fill in
+ * @return the number of bytes in the header, or -1 if it is malformed
+ */
+ssize_t readHeader(const unsigned char* contents, const unsigned char* end,
+		   FrequencyList* freq_list) {
+	const unsigned char* curr = contents;
+	/* Read the amount of characters in the header */
+	int size = (*curr) + 1;
+	int i;
+	curr += sizeof(uint8_t);
+	if ((size_t)(end - curr) < (size_t)size * HEADER_CHAR_SIZE) {
+		return -1;
+	}
+	for (i = 0; i < size; i++) {
+		uint8_t ascii = *curr;
+		uint32_t frequency;
+		memcpy(&frequency, curr + sizeof(uint8_t), sizeof(uint32_t));
+		frequency = ntohl(frequency);
+		curr += HEADER_CHAR_SIZE;
+		if (frequency == 0 || freq_list->frequencies[(int)ascii] > 0) {
+			return -1;
+		}
+		freq_list->frequencies[(int)ascii] = frequency;
+		++freq_list->num_non_zero_freq;
+	}
+	return curr - contents;
 }
 
 /**
@@ -79,7 +171,7 @@ void createHeader(FrequencyList* freq_list, int outfile) {
  * @param right - the right child of the node
  * @return a pointer to the node
  */
-HuffmanNode* createNode(char ascii, int freq, HuffmanNode* left,
+HuffmanNode* createNode(char ascii, uint64_t freq, HuffmanNode* left,
 			HuffmanNode* right, HuffmanNode* next) {
 	HuffmanNode* newNode = (HuffmanNode*)safe_malloc(sizeof(HuffmanNode));
 	newNode->char_ascii = ascii;
@@ -181,21 +273,48 @@ HuffmanNode* combine(HuffmanNode* a, HuffmanNode* b) {
 }
 
 /**
- * Creates a Huffman tree from an array of character frequencies
+ * Takes the next unused node from a pool, or allocates one if there is none
+ *
+ * @param pool - an array of nodes, or NULL to allocate
+ * @param used - the number of nodes of the pool already taken
+ * @param ascii - the ASCII character
+ * @param freq - the frequency of the character
+ * @return a pointer to the node
+ */
+static HuffmanNode* takeNode(HuffmanNode* pool, int* used, char ascii,
+			     uint64_t freq) {
+	HuffmanNode* newNode;
+	if (pool == NULL) {
+		return createNode(ascii, freq, NULL, NULL, NULL);
+	}
+	newNode = &pool[(*used)++];
+	newNode->char_ascii = ascii;
+	newNode->char_freq = freq;
+	newNode->left = NULL;
+	newNode->right = NULL;
+	newNode->next = NULL;
+	return newNode;
+}
+
+/**
+ * Creates a Huffman tree, taking its nodes from a pool if one is given
  *
  * @param frequencies - an array of character frequencies in ascending asci
  * order
+ * @param pool - an array of at least HUFFMAN_POOL_SIZE nodes, or NULL to
+ * allocate each node
  * @return the root of the Huffman tree
  */
-HuffmanNode* buildHuffmanTree(FrequencyList* frequencies) {
+static HuffmanNode* buildTree(FrequencyList* frequencies, HuffmanNode* pool) {
 	HuffmanNode* head;
+	int used = 0;
 	int i;
-	head = createNode(0, 0, NULL, NULL, NULL);
+	head = takeNode(pool, &used, 0, 0);
 	for (i = 0; i < MAX_CODE_LENGTH; i++) {
 		HuffmanNode* newNode;
 		if (frequencies->frequencies[i] > 0) {
-			newNode = createNode(i, frequencies->frequencies[i],
-					     NULL, NULL, NULL);
+			newNode = takeNode(pool, &used, i,
+					   frequencies->frequencies[i]);
 			insert(head, newNode);
 		}
 	}
@@ -206,8 +325,8 @@ HuffmanNode* buildHuffmanTree(FrequencyList* frequencies) {
 		HuffmanNode* rightNode = head->next->next;
 		/* create the new node */
 		HuffmanNode* newNode =
-		    createNode(0, leftNode->char_freq + rightNode->char_freq,
-			       NULL, NULL, NULL);
+		    takeNode(pool, &used, 0,
+			     leftNode->char_freq + rightNode->char_freq);
 		head->next = head->next->next->next;
 		leftNode->next = NULL;
 		rightNode->next = NULL;
@@ -219,10 +338,39 @@ HuffmanNode* buildHuffmanTree(FrequencyList* frequencies) {
 	HuffmanNode* oldHead;
 	oldHead = head;
 	head = head->next;
-	free(oldHead);
+	if (pool == NULL) {
+		free(oldHead);
+	}
 	return head;
 }
 
+/**
+ * Creates a Huffman tree from an array of character frequencies
+ *
+ * @param frequencies - an array of character frequencies in ascending asci
+ * order
+ * @return the root of the Huffman tree
+ */
+HuffmanNode* buildHuffmanTree(FrequencyList* frequencies) {
+	return buildTree(frequencies, NULL);
+}
+
+/**
+ * Creates a Huffman tree from an array of character frequencies without
+ * allocating, taking its nodes from a caller-provided pool. The tree is
+ * identical to the one buildHuffmanTree builds and must not be passed to
+ * freeHuffmanTree.
+ *
+ * @param frequencies - an array of character frequencies in ascending asci
+ * order
+ * @param pool - an array of at least HUFFMAN_POOL_SIZE nodes
+ * @return the root of the Huffman tree
+ */
+HuffmanNode* buildHuffmanTreeInPool(FrequencyList* frequencies,
+				    HuffmanNode* pool) {
+	return buildTree(frequencies, pool);
+}
+
 void buildCodesHelper(HuffmanNode* node, char** huffman_codes, char* code_str) {
 	if (node == NULL) {
 		return;
@@ -251,6 +399,45 @@ char** buildCodes(HuffmanNode* node) {
 	return huffman_codes;
 }
 
+/**
+ * Records the code of every leaf below a node in a CodeTable
+ *
+ * @param node - a pointer to the current node of the Huffman tree
+ * @param table - the CodeTable to fill in
+ * @param code - the bits of the path from the root to the node
+ * @param length - the number of bits in the path from the root to the node
+ */
+static void buildCodeTableHelper(HuffmanNode* node, CodeTable* table,
+				 uint64_t code, unsigned int length) {
+	if (node == NULL) {
+		return;
+	}
+	if (node->left == NULL && node->right == NULL) {
+		table->codes[(int)node->char_ascii] = code;
+		table->lengths[(int)node->char_ascii] = length;
+		if (length > table->max_length) {
+			table->max_length = length;
+		}
+	} else {
+		buildCodeTableHelper(node->left, table, code << 1, length + 1);
+		buildCodeTableHelper(node->right, table, (code << 1) | 1,
+				     length + 1);
+	}
+}
+
+/**
+ * Builds the integer form of the Huffman codes used by the coding kernels.
+ * Only the lowest 64 bits of a code are kept; codes of headers written by
+ * hencode are never that long.
+ *
+ * @param node - a pointer to the root of the Huffman tree
+ * @param table - the CodeTable to fill in
+ */
+void buildCodeTable(HuffmanNode* node, CodeTable* table) {
+	memset(table, 0, sizeof(CodeTable));
+	buildCodeTableHelper(node, table, 0, 0);
+}
+
 /**
  * Frees the memory allocated for a FrequencyList
  *
@@ -0,0 +1,387 @@
+#include "kernels.h"
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "huffman.h"
+
+#define BITS_PER_BYTE 8	 /* The number of bits in a byte */
+#define REFILL_BITS 56	 /* The fewest bits a refill leaves loaded */
+#define SMALL_CODE_BITS 11 /* The code length bounds with their own kernels */
+#define MEDIUM_CODE_BITS 12
+#define LARGE_CODE_BITS DECODE_TABLE_BITS
+
+/* The kernels below take their code length bound as a constant argument.
+ * Forcing them inline into a wrapper per bound lets the compiler unroll the
+ * inner loops and keep the bit buffer in registers for each bound. */
+#define KERNEL static inline __attribute__((always_inline))
+
+/**
+ * Writes out the whole bytes of the pending bits, leaving fewer than a byte
+ *
+ * @param bits - the pending bits, the most recent one in the lowest position
+ * @param count - the number of pending bits, at least one
+ * @param out - where to write the bytes, with ENCODE_SLACK bytes to spare
+ * @return the position after the bytes written
+ */
+KERNEL unsigned char* flushBits(uint64_t bits, unsigned int* count,
+				unsigned char* out) {
+	uint64_t aligned = htobe64(bits << (64 - *count));
+	memcpy(out, &aligned, sizeof(uint64_t));
+	out += *count / BITS_PER_BYTE;
+	*count %= BITS_PER_BYTE;
+	return out;
+}
+
+/**
+ * Packs the codes of a run of symbols, flushing after as many symbols as
+ * fit in the bit buffer when every code is at most max_length bits
+ *
+ * @param table - the codes of every character
+ * @param writer - the bits left over from the previous call
+ * @param contents - the symbols to encode
+ * @param size - the number of symbols to encode
+ * @param out - where to write the coded bytes
+ * @param max_length - a bound on the length of every code
+ * @return the number of bytes written
+ */
+KERNEL size_t encodeKernel(const CodeTable* table, BitWriter* writer,
+			   const unsigned char* contents, size_t size,
+			   unsigned char* out, const unsigned int max_length) {
+	const unsigned int per_flush = MAX_ENCODE_LENGTH / max_length;
+	uint64_t bits = writer->bits;
+	unsigned int count = writer->count;
+	unsigned char* curr = out;
+	size_t i = 0;
+	unsigned int j;
+	while (size - i >= per_flush) {
+		for (j = 0; j < per_flush; j++) {
+			unsigned char ascii = contents[i + j];
+			bits = (bits << table->lengths[ascii]) |
+			       table->codes[ascii];
+			count += table->lengths[ascii];
+		}
+		i += per_flush;
+		curr = flushBits(bits, &count, curr);
+	}
+	for (; i < size; i++) {
+		unsigned char ascii = contents[i];
+		bits = (bits << table->lengths[ascii]) | table->codes[ascii];
+		count += table->lengths[ascii];
+		curr = flushBits(bits, &count, curr);
+	}
+	writer->bits = bits;
+	writer->count = count;
+	return curr - out;
+}
+
+static size_t encodeSmall(const CodeTable* table, BitWriter* writer,
+			  const unsigned char* contents, size_t size,
+			  unsigned char* out) {
+	return encodeKernel(table, writer, contents, size, out,
+			    SMALL_CODE_BITS);
+}
+
+static size_t encodeMedium(const CodeTable* table, BitWriter* writer,
+			   const unsigned char* contents, size_t size,
+			   unsigned char* out) {
+	return encodeKernel(table, writer, contents, size, out,
+			    MEDIUM_CODE_BITS);
+}
+
+static size_t encodeLarge(const CodeTable* table, BitWriter* writer,
+			  const unsigned char* contents, size_t size,
+			  unsigned char* out) {
+	return encodeKernel(table, writer, contents, size, out,
+			    LARGE_CODE_BITS);
+}
+
+static size_t encodeAny(const CodeTable* table, BitWriter* writer,
+			const unsigned char* contents, size_t size,
+			unsigned char* out) {
+	return encodeKernel(table, writer, contents, size, out,
+			    MAX_ENCODE_LENGTH);
+}
+
+/**
+ * Encodes a run of symbols with the kernel for the table's longest code. The
+ * table must come from a tree with at least two leaves and no code longer
+ * than MAX_ENCODE_LENGTH, which holds for any block of at most
+ * MAX_BLOCK_SIZE bytes.
+ *
+ * @param table - the codes of every character
+ * @param writer - the bits left over from the previous call
+ * @param contents - the symbols to encode
+ * @param size - the number of symbols to encode
+ * @param out - where to write the coded bytes, with room for
+ * size * table->max_length / BITS_PER_BYTE + ENCODE_SLACK bytes
+ * @return the number of bytes written
+ */
+size_t encodeSymbols(const CodeTable* table, BitWriter* writer,
+		     const unsigned char* contents, size_t size,
+		     unsigned char* out) {
+	if (table->max_length <= SMALL_CODE_BITS) {
+		return encodeSmall(table, writer, contents, size, out);
+	} else if (table->max_length <= MEDIUM_CODE_BITS) {
+		return encodeMedium(table, writer, contents, size, out);
+	} else if (table->max_length <= LARGE_CODE_BITS) {
+		return encodeLarge(table, writer, contents, size, out);
+	} else {
+		return encodeAny(table, writer, contents, size, out);
+	}
+}
+
+/**
+ * Writes out the last partial byte of the coded bits, padded with zeros
+ *
+ * @param writer - the bits left over from the last call to encodeSymbols
+ * @param out - where to write the byte
+ * @return the number of bytes written
+ */
+size_t finishEncoding(BitWriter* writer, unsigned char* out) {
+	size_t written = 0;
+	if (writer->count > 0) {
+		out[0] = (unsigned char)(writer->bits
+					 << (BITS_PER_BYTE - writer->count));
+		written = 1;
+	}
+	writer->bits = 0;
+	writer->count = 0;
+	return written;
+}
+
+/**
+ * Loads bits until more than REFILL_BITS are valid, eight bytes at a time
+ * while they are available and then a byte at a time, with zeros past the
+ * end of the stream
+ *
+ * @param reader - the BitReader to refill
+ */
+KERNEL void refill(BitReader* reader) {
+	if (reader->end - reader->next >= (ptrdiff_t)sizeof(uint64_t)) {
+		uint64_t word;
+		unsigned int num_bytes = (63 - reader->count) / BITS_PER_BYTE;
+		memcpy(&word, reader->next, sizeof(uint64_t));
+		/* Bits past the loaded bytes are reloaded by the next refill */
+		reader->bits |= be64toh(word) >> reader->count;
+		reader->next += num_bytes;
+		reader->count += num_bytes * BITS_PER_BYTE;
+		reader->loaded += num_bytes * BITS_PER_BYTE;
+	} else {
+		while (reader->count <= REFILL_BITS) {
+			uint64_t byte =
+			    reader->next < reader->end ? *reader->next++ : 0;
+			reader->bits |= byte << (REFILL_BITS - reader->count);
+			reader->count += BITS_PER_BYTE;
+			reader->loaded += BITS_PER_BYTE;
+		}
+	}
+}
+
+/**
+ * Decodes a run of symbols with one table lookup each, decoding after each
+ * refill as many symbols as its bits are guaranteed to hold
+ *
+ * @param decoder - the Decoder with a table indexed by table_bits bits
+ * @param out - where to write the symbols
+ * @param size - the number of symbols to decode
+ * @param table_bits - the table's index width, a bound on every code length
+ */
+KERNEL void decodeKernel(Decoder* decoder, unsigned char* out, size_t size,
+			 const unsigned int table_bits) {
+	const unsigned int per_refill = REFILL_BITS / table_bits;
+	const uint16_t* table = decoder->table;
+	BitReader reader = decoder->reader;
+	size_t i = 0;
+	unsigned int j;
+	while (size - i >= per_refill) {
+		refill(&reader);
+		for (j = 0; j < per_refill; j++) {
+			uint16_t entry = table[reader.bits >> (64 - table_bits)];
+			out[i + j] = (unsigned char)entry;
+			reader.bits <<= entry >> BITS_PER_BYTE;
+			reader.count -= entry >> BITS_PER_BYTE;
+		}
+		i += per_refill;
+	}
+	for (; i < size; i++) {
+		uint16_t entry;
+		refill(&reader);
+		entry = table[reader.bits >> (64 - table_bits)];
+		out[i] = (unsigned char)entry;
+		reader.bits <<= entry >> BITS_PER_BYTE;
+		reader.count -= entry >> BITS_PER_BYTE;
+	}
+	decoder->reader = reader;
+}
+
+static void decodeSmall(Decoder* decoder, unsigned char* out, size_t size) {
+	decodeKernel(decoder, out, size, SMALL_CODE_BITS);
+}
+
+static void decodeMedium(Decoder* decoder, unsigned char* out, size_t size) {
+	decodeKernel(decoder, out, size, MEDIUM_CODE_BITS);
+}
+
+static void decodeLarge(Decoder* decoder, unsigned char* out, size_t size) {
+	decodeKernel(decoder, out, size, LARGE_CODE_BITS);
+}
+
+/**
+ * Decodes a run of symbols with one table lookup each, for tables that hold
+ * codes longer than the table resolves. An entry with no length marks a
+ * subtree below the table's reach, which is walked a bit at a time, so only
+ * the rare long codes leave the table.
+ *
+ * @param decoder - the Decoder with a LARGE_CODE_BITS table and its subtrees
+ * @param out - where to write the symbols
+ * @param size - the number of symbols to decode
+ */
+static void decodeOverflow(Decoder* decoder, unsigned char* out,
+			   size_t size) {
+	const uint16_t* table = decoder->table;
+	BitReader reader = decoder->reader;
+	size_t i;
+	for (i = 0; i < size; i++) {
+		uint16_t entry;
+		if (reader.count < LARGE_CODE_BITS) {
+			refill(&reader);
+		}
+		entry = table[reader.bits >> (64 - LARGE_CODE_BITS)];
+		if (entry >> BITS_PER_BYTE) {
+			out[i] = (unsigned char)entry;
+			reader.bits <<= entry >> BITS_PER_BYTE;
+			reader.count -= entry >> BITS_PER_BYTE;
+		} else {
+			HuffmanNode* curr_node =
+			    decoder->subtrees[(unsigned char)entry];
+			reader.bits <<= LARGE_CODE_BITS;
+			reader.count -= LARGE_CODE_BITS;
+			while (curr_node->left != NULL) {
+				if (reader.count == 0) {
+					refill(&reader);
+				}
+				curr_node = (reader.bits >> 63) ? curr_node->right
+								: curr_node->left;
+				reader.bits <<= 1;
+				reader.count--;
+			}
+			out[i] = curr_node->char_ascii;
+		}
+	}
+	decoder->reader = reader;
+}
+
+/**
+ * Marks the table entries of every subtree that starts exactly at the
+ * table's depth, giving each the index of the subtree in the low byte and no
+ * length
+ *
+ * @param decoder - the Decoder whose table to fill
+ * @param node - the internal node to search below
+ * @param code - the code of node
+ * @param depth - the depth of node, less than LARGE_CODE_BITS
+ */
+static void fillOverflow(Decoder* decoder, HuffmanNode* node, uint32_t code,
+			 unsigned int depth) {
+	int i;
+	for (i = 0; i < 2; i++) {
+		HuffmanNode* child = i ? node->right : node->left;
+		uint32_t child_code = (code << 1) | i;
+		if (child->left == NULL) {
+			continue;
+		} else if (depth + 1 == LARGE_CODE_BITS) {
+			decoder->table[child_code] = decoder->num_subtrees;
+			decoder->subtrees[decoder->num_subtrees++] = child;
+		} else {
+			fillOverflow(decoder, child, child_code, depth + 1);
+		}
+	}
+}
+
+/**
+ * Prepares a Decoder for the coded bits of a block, choosing the narrowest
+ * table that resolves every code in one lookup, or the widest table with the
+ * longer codes left to their subtrees
+ *
+ * @param decoder - the Decoder to initialize
+ * @param root - the root of a Huffman tree with at least two leaves
+ * @param table - the codes of every character in the tree
+ * @param start - the first byte of the coded bits
+ * @param end - one past the last byte of the coded bits
+ */
+void initDecoder(Decoder* decoder, HuffmanNode* root, const CodeTable* table,
+		 const unsigned char* start, const unsigned char* end) {
+	int i;
+	decoder->max_length = table->max_length;
+	decoder->num_subtrees = 0;
+	if (table->max_length <= SMALL_CODE_BITS) {
+		decoder->table_bits = SMALL_CODE_BITS;
+	} else if (table->max_length <= MEDIUM_CODE_BITS) {
+		decoder->table_bits = MEDIUM_CODE_BITS;
+	} else {
+		decoder->table_bits = LARGE_CODE_BITS;
+	}
+	/* Every index that starts with a code maps to that code */
+	for (i = 0; i < MAX_CODE_LENGTH; i++) {
+		if (table->lengths[i] > 0 &&
+		    table->lengths[i] <= decoder->table_bits) {
+			unsigned int unused =
+			    decoder->table_bits - table->lengths[i];
+			uint32_t first = (uint32_t)table->codes[i] << unused;
+			uint32_t index;
+			for (index = first; index < first + (1u << unused);
+			     index++) {
+				decoder->table[index] =
+				    (uint16_t)(i | (table->lengths[i]
+						    << BITS_PER_BYTE));
+			}
+		}
+	}
+	/* Every other index starts inside a code that overflows the table */
+	if (table->max_length > LARGE_CODE_BITS) {
+		fillOverflow(decoder, root, 0, 0);
+	}
+	decoder->reader.next = start;
+	decoder->reader.end = end;
+	decoder->reader.bits = 0;
+	decoder->reader.count = 0;
+	decoder->reader.loaded = 0;
+}
+
+/**
+ * Decodes a run of symbols with the kernel chosen by initDecoder
+ *
+ * @param decoder - the Decoder to decode with
+ * @param out - where to write the symbols
+ * @param size - the number of symbols to decode
+ */
+void decodeSymbols(Decoder* decoder, unsigned char* out, size_t size) {
+	if (decoder->max_length > LARGE_CODE_BITS) {
+		decodeOverflow(decoder, out, size);
+		return;
+	}
+	switch (decoder->table_bits) {
+		case SMALL_CODE_BITS:
+			decodeSmall(decoder, out, size);
+			break;
+		case MEDIUM_CODE_BITS:
+			decodeMedium(decoder, out, size);
+			break;
+		default:
+			decodeLarge(decoder, out, size);
+			break;
+	}
+}
+
+/**
+ * Returns the number of coded bits consumed by the symbols decoded so far
+ *
+ * @param decoder - the Decoder to inspect
+ * @return the number of bits consumed
+ */
+uint64_t decodedBits(const Decoder* decoder) {
+	return decoder->reader.loaded - decoder->reader.count;
+}
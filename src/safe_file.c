@@ -1,13 +1,19 @@
+#define _GNU_SOURCE
 #include "safe_file.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "safe_mem.h"
 
 #define FILE_ERROR -1
+#define READ_CHUNK_SIZE 65536 /* read size when the file size is unknown */
 
 /**
  * A safe version of fopen that validates file opening and exits on failure
@@ -26,7 +32,8 @@ int safe_open(char *filename, int flags, mode_t mode) {
 }
 
 /**
- * Opens a file and stores the contents in a FileContent
+ * Opens a file and stores the contents in a FileContent. Reads until end of
+ * file, so pipes and sockets whose size fstat cannot report are read in full.
  *
  * @param fd the file pointer to read from
  */
@@ -39,19 +46,56 @@ FileContent *safe_read(int fd) {
 	} else {
 		FileContent *file_content =
 		    (FileContent *)safe_calloc(sizeof(FileContent), 1);
-		file_content->file_size = file_info.st_size;
-		file_content->file_contents = (unsigned char *)safe_calloc(
-		    sizeof(unsigned char), file_content->file_size);
-		if (read(fd, file_content->file_contents,
-			 file_content->file_size) == FILE_ERROR) {
-			perror("Error reading file");
-			freeFileContent(file_content);
-			close(fd);
-			exit(EXIT_FAILURE);
-		} else {
-			return file_content;
+		/* One spare byte lets a regular file reach end of file without
+		 * growing the buffer */
+		size_t capacity = S_ISREG(file_info.st_mode) && file_info.st_size
+				      ? (size_t)file_info.st_size + 1
+				      : READ_CHUNK_SIZE;
+		size_t size = 0;
+		ssize_t bytes_read;
+		if (S_ISREG(file_info.st_mode)) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 		}
+		file_content->file_contents =
+		    (unsigned char *)safe_malloc(capacity);
+		while ((bytes_read = read(fd, file_content->file_contents + size,
+					  capacity - size)) != 0) {
+			if (bytes_read == FILE_ERROR) {
+				perror("Error reading file");
+				freeFileContent(file_content);
+				close(fd);
+				exit(EXIT_FAILURE);
+			}
+			size += bytes_read;
+			if (size == capacity) {
+				capacity *= 2;
+				file_content->file_contents =
+				    (unsigned char *)safe_realloc(
+					file_content->file_contents, capacity);
+			}
+		}
+		file_content->file_size = size;
+		return file_content;
+	}
+}
+
+/**
+ * Reads the next part of a file into a fixed buffer, for passes that look at
+ * each byte once and need not hold the whole file
+ *
+ * @param fd the file descriptor to read from
+ * @param buf where to store the bytes
+ * @param count the size of buf
+ * @return the number of bytes read, 0 at end of file
+ */
+size_t safe_read_chunk(int fd, unsigned char *buf, size_t count) {
+	ssize_t bytes_read = read(fd, buf, count);
+	if (bytes_read == FILE_ERROR) {
+		perror("Error reading file");
+		close(fd);
+		exit(EXIT_FAILURE);
 	}
+	return bytes_read;
 }
 
 /**
@@ -61,10 +105,65 @@ FileContent *safe_read(int fd) {
  * @return a pointer to the successfully opened file
  */
 void safe_write(int fd, void *buf, size_t count) {
-	if (write(fd, buf, count) == FILE_ERROR) {
-		perror("Error writing to file");
+	ssize_t bytes_written;
+	while (count > 0) {
+		if ((bytes_written = write(fd, buf, count)) == FILE_ERROR) {
+			perror("Error writing to file");
+			exit(EXIT_FAILURE);
+		}
+		buf = (unsigned char *)buf + bytes_written;
+		count -= bytes_written;
+	}
+}
+
+/**
+ * Writes a run of one repeated byte without copying it through user space
+ * once per byte. The run is laid out once in a private mapping that is never
+ * modified afterwards, so when the output is a pipe its pages can be spliced
+ * in by reference with vmsplice; other outputs write the block repeatedly.
+ *
+ * @param fd the file descriptor to write to
+ * @param byte the byte to repeat
+ * @param count the number of times to write the byte
+ */
+void safe_write_run(int fd, unsigned char byte, size_t count) {
+	struct stat file_info;
+	size_t block_size = count < WRITE_BUFFER_SIZE ? count : WRITE_BUFFER_SIZE;
+	unsigned char *block;
+	int use_splice;
+	if (count == 0) {
+		return;
+	}
+	block = (unsigned char *)mmap(NULL, block_size, PROT_READ | PROT_WRITE,
+				      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED) {
+		perror("Memory allocation error");
 		exit(EXIT_FAILURE);
 	}
+	memset(block, byte, block_size);
+	use_splice = fstat(fd, &file_info) != FILE_ERROR &&
+		     S_ISFIFO(file_info.st_mode);
+	while (count > 0) {
+		struct iovec iov;
+		ssize_t bytes_written;
+		iov.iov_base = block;
+		iov.iov_len = count < block_size ? count : block_size;
+		if (use_splice) {
+			bytes_written = vmsplice(fd, &iov, 1, 0);
+			if (bytes_written == FILE_ERROR) {
+				/* Fall back to copying, e.g. for non-blocking pipes */
+				use_splice = 0;
+				continue;
+			}
+		} else if ((bytes_written = write(fd, iov.iov_base,
+						  iov.iov_len)) == FILE_ERROR) {
+			perror("Error writing to file");
+			exit(EXIT_FAILURE);
+		}
+		count -= bytes_written;
+	}
+	/* The pipe keeps its own references to the spliced pages */
+	munmap(block, block_size);
 }
 
 /**
@@ -76,3 +175,269 @@ void freeFileContent(FileContent *file_contents) {
 	safe_free(file_contents->file_contents);
 	free(file_contents);
 }
+
+/**
+ * Reads a regular file front to back, publishing each chunk as it arrives
+ *
+ * @param arg the FileReader that owns the thread
+ * @return NULL
+ */
+static void *readerThread(void *arg) {
+	FileReader *reader = (FileReader *)arg;
+	size_t available = 0;
+	while (available < reader->size) {
+		size_t remaining = reader->size - available;
+		ssize_t bytes_read =
+		    read(reader->fd, reader->contents + available,
+			 remaining < READ_AHEAD_SIZE ? remaining
+						     : READ_AHEAD_SIZE);
+		if (bytes_read == FILE_ERROR) {
+			perror("Error reading file");
+			exit(EXIT_FAILURE);
+		} else if (bytes_read == 0) {
+			/* The file shrank since it was measured */
+			break;
+		}
+		available += bytes_read;
+		pthread_mutex_lock(&reader->lock);
+		reader->available = available;
+		pthread_cond_broadcast(&reader->cond);
+		if (reader->stop) {
+			pthread_mutex_unlock(&reader->lock);
+			break;
+		}
+		pthread_mutex_unlock(&reader->lock);
+	}
+	pthread_mutex_lock(&reader->lock);
+	reader->done = 1;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+/**
+ * Creates a FileReader for a file. A regular file is read on a background
+ * thread into a buffer of its full size, so its contents never move. Other
+ * files, whose size fstat cannot report, are read in full up front.
+ *
+ * @param fd the file descriptor to read from
+ * @return a pointer to the FileReader
+ */
+FileReader *createFileReader(int fd) {
+	struct stat file_info;
+	FileReader *reader = (FileReader *)safe_calloc(sizeof(FileReader), 1);
+	if (fstat(fd, &file_info) == FILE_ERROR) {
+		perror("Error getting file information");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	reader->fd = fd;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+	if (S_ISREG(file_info.st_mode) && file_info.st_size > 0) {
+		reader->size = file_info.st_size;
+		/* Zeroed so bytes missing from a shrunken file are defined */
+		reader->contents =
+		    (unsigned char *)safe_calloc(reader->size, 1);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		reader->threaded = 1;
+		if (pthread_create(&reader->thread, NULL, readerThread,
+				   reader) != 0) {
+			perror("Error creating reader thread");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		FileContent *file_content = safe_read(fd);
+		reader->contents = file_content->file_contents;
+		reader->size = file_content->file_size;
+		reader->available = reader->size;
+		reader->done = 1;
+		free(file_content);
+	}
+	return reader;
+}
+
+/**
+ * Waits until the first count bytes of the file have been read
+ *
+ * @param reader the FileReader to wait on
+ * @param count the number of bytes needed, capped at the file size
+ * @return 0 once the bytes are available, -1 if the file ended before them
+ */
+int waitForBytes(FileReader *reader, size_t count) {
+	int status;
+	if (count > reader->size) {
+		count = reader->size;
+	}
+	pthread_mutex_lock(&reader->lock);
+	while (reader->available < count && !reader->done) {
+		pthread_cond_wait(&reader->cond, &reader->lock);
+	}
+	status = reader->available < count ? -1 : 0;
+	pthread_mutex_unlock(&reader->lock);
+	return status;
+}
+
+/**
+ * Stops a FileReader's thread, without reading the rest of the file, and frees
+ * its memory
+ *
+ * @param reader the FileReader to free
+ */
+void freeFileReader(FileReader *reader) {
+	if (reader->threaded) {
+		pthread_mutex_lock(&reader->lock);
+		reader->stop = 1;
+		pthread_mutex_unlock(&reader->lock);
+		pthread_join(reader->thread, NULL);
+	}
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->cond);
+	safe_free(reader->contents);
+	safe_free(reader);
+}
+
+/**
+ * Writes each buffer handed over by the coder until the writer is closed
+ *
+ * @param arg the BufferedWriter that owns the thread
+ * @return NULL
+ */
+static void *writerThread(void *arg) {
+	BufferedWriter *writer = (BufferedWriter *)arg;
+	pthread_mutex_lock(&writer->lock);
+	while (1) {
+		while (writer->pending == 0 && !writer->done) {
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		}
+		if (writer->pending == 0) {
+			break;
+		}
+		/* The coder never touches the inactive buffer while it is pending */
+		pthread_mutex_unlock(&writer->lock);
+		safe_write(writer->fd, writer->buffers[!writer->active],
+			   writer->pending);
+		pthread_mutex_lock(&writer->lock);
+		writer->pending = 0;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+/**
+ * Creates a BufferedWriter so that a buffer is written to disk while the next
+ * one is being filled, overlapping coding with output
+ *
+ * @param fd the file descriptor to write to
+ * @return a pointer to the BufferedWriter
+ */
+BufferedWriter *createBufferedWriter(int fd) {
+	BufferedWriter *writer =
+	    (BufferedWriter *)safe_calloc(sizeof(BufferedWriter), 1);
+	writer->fd = fd;
+	writer->buffers[0] = (unsigned char *)safe_malloc(WRITE_BUFFER_SIZE);
+	writer->buffers[1] = (unsigned char *)safe_malloc(WRITE_BUFFER_SIZE);
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+		perror("Error creating writer thread");
+		exit(EXIT_FAILURE);
+	}
+	return writer;
+}
+
+/**
+ * Hands the buffer being filled to the writer thread and switches to the
+ * other one, waiting first if the writer thread is still busy with it
+ *
+ * @param writer the BufferedWriter to swap
+ */
+static void swapBuffers(BufferedWriter *writer) {
+	pthread_mutex_lock(&writer->lock);
+	while (writer->pending > 0) {
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	}
+	writer->pending = writer->filled;
+	writer->active = !writer->active;
+	writer->filled = 0;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * Copies bytes into the active buffer, handing it off whenever it fills
+ *
+ * @param writer the BufferedWriter to write to
+ * @param buf the bytes to write
+ * @param count the number of bytes to write
+ */
+void buffered_write(BufferedWriter *writer, const void *buf, size_t count) {
+	const unsigned char *bytes = (const unsigned char *)buf;
+	while (count > 0) {
+		size_t space = WRITE_BUFFER_SIZE - writer->filled;
+		size_t amount = count < space ? count : space;
+		memcpy(writer->buffers[writer->active] + writer->filled, bytes,
+		       amount);
+		writer->filled += amount;
+		bytes += amount;
+		count -= amount;
+		if (writer->filled == WRITE_BUFFER_SIZE) {
+			swapBuffers(writer);
+		}
+	}
+}
+
+/**
+ * Writes out everything buffered so far and waits until it reaches the file
+ *
+ * @param writer the BufferedWriter to flush
+ */
+void flushBufferedWriter(BufferedWriter *writer) {
+	if (writer->filled > 0) {
+		swapBuffers(writer);
+	}
+	pthread_mutex_lock(&writer->lock);
+	while (writer->pending > 0) {
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * Writes a run of one repeated byte after everything buffered so far
+ *
+ * @param writer the BufferedWriter to write to
+ * @param byte the byte to repeat
+ * @param count the number of times to write the byte
+ */
+void buffered_write_run(BufferedWriter *writer, unsigned char byte,
+			size_t count) {
+	if (count < WRITE_BUFFER_SIZE - writer->filled) {
+		memset(writer->buffers[writer->active] + writer->filled, byte,
+		       count);
+		writer->filled += count;
+	} else {
+		flushBufferedWriter(writer);
+		safe_write_run(writer->fd, byte, count);
+	}
+}
+
+/**
+ * Flushes a BufferedWriter, stops its thread and frees its memory
+ *
+ * @param writer the BufferedWriter to free
+ */
+void freeBufferedWriter(BufferedWriter *writer) {
+	flushBufferedWriter(writer);
+	pthread_mutex_lock(&writer->lock);
+	writer->done = 1;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->cond);
+	safe_free(writer->buffers[0]);
+	safe_free(writer->buffers[1]);
+	safe_free(writer);
+}
@@ -0,0 +1,293 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "codec.h"
+#include "huffman.h"
+#include "safe_mem.h"
+
+#define NUM_RANDOM_CASES 64   /* random distributions to round-trip */
+#define MAX_RANDOM_SIZE 65536 /* largest random input in bytes */
+#define NUM_MUTATIONS 32      /* corrupted copies decoded per case */
+#define FIB_DEPTH 30	      /* symbols with Fibonacci frequencies */
+#define MAX_FIB_BLOCKS 64     /* blocks past which deeper inputs are skipped */
+
+/* The decode fuzz harness, which also checks hdecode's streaming decoder */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static int failures = 0;
+/* One workspace reused by every call, as a pooled worker would */
+static CodecWorkspace* workspace;
+static uint64_t rng_state = 88172645463325252ull;
+
+/**
+ * Returns the next number of a fixed xorshift sequence, so every run tests
+ * the same inputs
+ *
+ * @return a pseudo-random 64-bit number
+ */
+static uint64_t nextRandom(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/**
+ * Reports a failed check for a named case
+ *
+ * @param name - the name of the case
+ * @param what - the check that failed
+ */
+static void fail(const char* name, const char* what) {
+	fprintf(stderr, "FAIL %s: %s\n", name, what);
+	failures++;
+}
+
+/**
+ * Decodes corrupted copies of a compressed buffer, checking that the decoder
+ * either refuses them or agrees with its own size, and that hdecode's
+ * streaming decoder agrees with both. The sanitizers catch any read or write
+ * out of bounds.
+ *
+ * @param encoded - the compressed bytes
+ * @param size - the number of compressed bytes
+ */
+static void mutate(const unsigned char* encoded, size_t size) {
+	unsigned char* copy = (unsigned char*)safe_malloc(size + 1);
+	int i;
+	for (i = 0; i < NUM_MUTATIONS && size > 0; i++) {
+		size_t copy_size = size;
+		ssize_t decoded_size;
+		memcpy(copy, encoded, size);
+		if (i % 2 == 0) {
+			copy[nextRandom() % size] ^= 1 << (nextRandom() % 8);
+		} else {
+			copy_size = nextRandom() % size;
+		}
+		decoded_size = hdecodeSize(copy, copy_size);
+		if (decoded_size >= 0 && decoded_size <= MAX_RANDOM_SIZE * 4) {
+			unsigned char* out =
+			    (unsigned char*)safe_malloc(decoded_size + 1);
+			ssize_t written =
+			    hdecodeBuffer(copy, copy_size, out, decoded_size);
+			if (written >= 0 && written != decoded_size) {
+				fail("mutation", "decoded size disagrees");
+			}
+			safe_free(out);
+		}
+		LLVMFuzzerTestOneInput(copy, copy_size);
+	}
+	safe_free(copy);
+}
+
+/**
+ * Compresses and decompresses an input through the memory-to-memory API,
+ * checking the sizes, the exact-fit and one-short buffers, and the bytes
+ *
+ * @param name - the name of the case
+ * @param contents - the bytes to round-trip
+ * @param size - the number of bytes
+ */
+static void roundTrip(const char* name, const unsigned char* contents,
+		      size_t size) {
+	size_t bound = hencodeBound(size);
+	unsigned char* encoded = (unsigned char*)safe_malloc(bound + 1);
+	unsigned char* exact = (unsigned char*)safe_malloc(bound + 1);
+	unsigned char* decoded = (unsigned char*)safe_malloc(size + 1);
+	Estimate estimate;
+	ssize_t encoded_size = hencodeBuffer(contents, size, encoded, bound);
+	if (encoded_size < 0) {
+		fail(name, "hencodeBuffer refused hencodeBound bytes");
+	} else {
+		hencodeEstimate(contents, size, &estimate);
+		if (estimate.compressed_size != (uint64_t)encoded_size) {
+			fail(name, "estimate differs from compressed size");
+		}
+		if (hencodeBufferWith(contents, size, exact, encoded_size,
+				      workspace) != encoded_size ||
+		    memcmp(exact, encoded, encoded_size) != 0) {
+			fail(name, "exact-fit encode differs");
+		}
+		if (encoded_size > 0 &&
+		    hencodeBuffer(contents, size, exact, encoded_size - 1) >=
+			0) {
+			fail(name, "encode into a short buffer succeeded");
+		}
+		if (hdecodeSize(encoded, encoded_size) != (ssize_t)size ||
+		    hdecodeSizeWith(encoded, encoded_size, workspace) !=
+			(ssize_t)size) {
+			fail(name, "hdecodeSize differs from input size");
+		}
+		if (hdecodeBuffer(encoded, encoded_size, decoded, size) !=
+			(ssize_t)size ||
+		    memcmp(decoded, contents, size) != 0) {
+			fail(name, "decoded bytes differ");
+		}
+		memset(decoded, 0, size);
+		if (hdecodeBufferWith(encoded, encoded_size, decoded, size,
+				      workspace) != (ssize_t)size ||
+		    memcmp(decoded, contents, size) != 0) {
+			fail(name, "decoded bytes differ with a workspace");
+		}
+		if (size > 0 &&
+		    hdecodeBuffer(encoded, encoded_size, decoded, size - 1) >=
+			0) {
+			fail(name, "decode into a short buffer succeeded");
+		}
+		LLVMFuzzerTestOneInput(encoded, encoded_size);
+		mutate(encoded, encoded_size);
+	}
+	safe_free(encoded);
+	safe_free(exact);
+	safe_free(decoded);
+}
+
+/**
+ * Fills a buffer with symbols drawn from a random distribution over a random
+ * alphabet, with weights skewed so some symbols are rare
+ *
+ * @param contents - the buffer to fill
+ * @param size - the number of bytes to fill
+ */
+static void fillRandom(unsigned char* contents, size_t size) {
+	uint64_t weights[MAX_CODE_LENGTH];
+	uint64_t total = 0;
+	int num_symbols = 1 + nextRandom() % MAX_CODE_LENGTH;
+	size_t i;
+	int j;
+	for (j = 0; j < num_symbols; j++) {
+		weights[j] = 1 + (nextRandom() % 1024) * (nextRandom() % 1024);
+		total += weights[j];
+	}
+	for (i = 0; i < size; i++) {
+		uint64_t pick = nextRandom() % total;
+		for (j = 0; pick >= weights[j]; j++) {
+			pick -= weights[j];
+		}
+		contents[i] = (unsigned char)(j * 7 + 3);
+	}
+}
+
+/**
+ * Builds an input whose symbols have Fibonacci frequencies, the smallest
+ * input that gives a Huffman tree of the greatest depth for its alphabet
+ *
+ * @param depth - the number of symbols, one more than the deepest code
+ * @param size - where to store the number of bytes
+ * @return the input, which the caller frees
+ */
+static unsigned char* fibonacciInput(int depth, size_t* size) {
+	uint64_t prev = 1;
+	uint64_t curr = 1;
+	unsigned char* contents;
+	size_t offset = 0;
+	int i;
+	*size = 0;
+	for (i = 0; i < depth; i++) {
+		uint64_t next = prev + curr;
+		*size += prev;
+		prev = curr;
+		curr = next;
+	}
+	contents = (unsigned char*)safe_malloc(*size);
+	prev = 1;
+	curr = 1;
+	for (i = 0; i < depth; i++) {
+		uint64_t next = prev + curr;
+		memset(contents + offset, 255 - i, prev);
+		offset += prev;
+		prev = curr;
+		curr = next;
+	}
+	/* Shuffle so the coded bits do not come out in runs */
+	for (offset = *size - 1; offset > 0; offset--) {
+		size_t other = nextRandom() % (offset + 1);
+		unsigned char swap = contents[offset];
+		contents[offset] = contents[other];
+		contents[other] = swap;
+	}
+	return contents;
+}
+
+/**
+ * Checks that headers hencode never writes are refused
+ */
+static void malformedHeaders(void) {
+	/* Two entries for 'a', each with one occurrence */
+	const unsigned char duplicate[] = {1, 'a', 0, 0, 0, 1,
+					   'a', 0, 0, 0, 1, 0};
+	/* 'b' with a frequency of zero */
+	const unsigned char zero[] = {1, 'a', 0, 0, 0, 1, 'b', 0, 0, 0, 0, 0};
+	/* Two characters but only one entry */
+	const unsigned char short_header[] = {1, 'a', 0, 0, 0, 1};
+	if (hdecodeSize(duplicate, sizeof(duplicate)) >= 0) {
+		fail("duplicate", "duplicate character accepted");
+	}
+	if (hdecodeSize(zero, sizeof(zero)) >= 0) {
+		fail("zero", "zero frequency accepted");
+	}
+	if (hdecodeSize(short_header, sizeof(short_header)) >= 0) {
+		fail("short header", "truncated header accepted");
+	}
+}
+
+int main(void) {
+	unsigned char* contents =
+	    (unsigned char*)safe_malloc(MAX_RANDOM_SIZE * 4);
+	char name[64];
+	size_t size;
+	int i;
+	workspace = (CodecWorkspace*)safe_malloc(codecWorkspaceSize());
+	roundTrip("empty", contents, 0);
+	/* One symbol: a header-only block */
+	contents[0] = 'x';
+	roundTrip("one byte", contents, 1);
+	memset(contents, 'x', MAX_RANDOM_SIZE);
+	roundTrip("one symbol", contents, MAX_RANDOM_SIZE);
+	/* Two symbols: the shortest possible codes */
+	contents[MAX_RANDOM_SIZE / 2] = 'y';
+	roundTrip("two symbols", contents, MAX_RANDOM_SIZE);
+	/* Every byte value, uniformly and with a skew */
+	for (i = 0; i < MAX_RANDOM_SIZE; i++) {
+		contents[i] = (unsigned char)i;
+	}
+	roundTrip("256 symbols", contents, MAX_RANDOM_SIZE);
+	for (i = 0; i < MAX_RANDOM_SIZE * 4; i++) {
+		contents[i] = (unsigned char)(i % (1 + i % 256));
+	}
+	roundTrip("256 skewed symbols", contents, MAX_RANDOM_SIZE * 4);
+	safe_free(contents);
+	/* Trees of every depth around the decode table widths, up to
+	 * FIB_DEPTH - 1 bits. A deeper tree needs more input than a block's
+	 * 32-bit frequencies allow long before its 256 symbols are used.
+	 * With small blocks, a deeper input only repeats shallower blocks. */
+	for (i = 10; i <= FIB_DEPTH; i++) {
+		contents = fibonacciInput(i, &size);
+		if (size / MAX_BLOCK_SIZE <= MAX_FIB_BLOCKS) {
+			snprintf(name, sizeof(name), "fibonacci depth %d",
+				 i - 1);
+			roundTrip(name, contents, size);
+		}
+		safe_free(contents);
+	}
+	contents = (unsigned char*)safe_malloc(MAX_RANDOM_SIZE);
+	for (i = 0; i < NUM_RANDOM_CASES; i++) {
+		size = 1 + nextRandom() % MAX_RANDOM_SIZE;
+		fillRandom(contents, size);
+		snprintf(name, sizeof(name), "random %d", i);
+		roundTrip(name, contents, size);
+	}
+	safe_free(contents);
+	malformedHeaders();
+	safe_free(workspace);
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("roundtrip_test: all checks passed\n");
+	return 0;
+}